@@ -4,6 +4,10 @@
 #include <cstdint>
 #include <random>
 
+struct traceState;
+class traceWriter;
+class metrics;
+
 class chip8 {
     private:
         
@@ -29,6 +33,25 @@ class chip8 {
         uint8_t NN;
         uint16_t NNN;
 
+        // RAM range written by the last executed instruction
+        uint16_t memWriteAddr;
+        uint8_t memWriteLen;
+
+        // Timers written by the last executed instruction (TRACE_DT, TRACE_ST)
+        uint8_t timerWrites;
+
+        // VIP timing: cost of the last instruction, cycles left in the
+        // current frame and whether it ended waiting for vertical blank
+        uint32_t cycles;
+        int32_t cycleBudget;
+        bool vblankWait;
+
+        // Execution tracing, disabled when null
+        traceWriter* tracer = nullptr;
+
+        // Runtime metrics, disabled when null
+        metrics* stats = nullptr;
+
         // PRNG
         std::mt19937 mt{};
         std::uniform_int_distribution<uint8_t> rand8bit{};
@@ -42,10 +65,15 @@ class chip8 {
         void fetch();
         void decode();
         void execute(bool modernShift, bool keys[]);
+        void runFrame(bool modernShift, bool keys[]);
 
         void disassemble();
         void debug();
 
+        void captureState(traceState& state);
+        void setTracer(traceWriter* t);
+        void setMetrics(metrics* m);
+
         void decreaseTimers();
         bool isBeeping();
 
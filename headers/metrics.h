@@ -0,0 +1,88 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// All metrics are written by the emulation thread only, so updates are a
+// relaxed load and store instead of a locked read-modify-write. Readers on
+// other threads may see a scrape that is one update behind, never a torn value.
+
+class metricsCounter {
+    private:
+        std::atomic<uint64_t> value{0};
+
+    public:
+        void add(uint64_t n){ value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+        uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+class metricsGauge {
+    private:
+        std::atomic<double> value{0};
+
+    public:
+        void set(double v){ value.store(v, std::memory_order_relaxed); }
+        double get() const { return value.load(std::memory_order_relaxed); }
+};
+
+#define METRICS_BUCKETS 10
+
+// Durations in nanoseconds, exported in seconds
+class metricsHistogram {
+    private:
+        std::atomic<uint64_t> buckets[METRICS_BUCKETS + 1]{}; // Last bucket is +Inf
+        std::atomic<uint64_t> sum{0};
+
+    public:
+        static const uint64_t bounds[METRICS_BUCKETS];
+
+        void observe(uint64_t ns);
+        void render(std::string& out, const char* name, const char* help) const;
+};
+
+// Registry of everything exported on the metrics endpoint
+class metrics {
+    public:
+        metricsCounter instructions;    // Instructions executed by the core
+        metricsCounter invalidOpcodes;  // Opcodes execute() couldn't decode
+        metricsGauge ips;               // Instructions per second over the last second
+
+        metricsHistogram emulateTime;   // fetch, decode and execute
+        metricsHistogram uploadTime;    // Video buffer to texture
+        metricsHistogram presentTime;   // Clear, copy and present
+
+        metricsCounter droppedFrames;   // Scheduler ticks missed by a late frame
+
+        metricsGauge audioQueued;       // Bytes queued on the audio stream
+        metricsCounter audioUnderruns;  // Times the queue ran dry during a beep
+
+        std::string render() const;
+};
+
+// Serves the registry as Prometheus text over HTTP on a Unix socket
+class metricsServer {
+    private:
+        const metrics& registry;
+        std::string path;
+
+        int listenFD = -1;
+        std::atomic<bool> stopping{false};
+        std::thread server;
+
+        void serverLoop();
+
+    public:
+        metricsServer(const metrics& m) : registry(m) {}
+        ~metricsServer();
+
+        metricsServer(const metricsServer&) = delete;
+        metricsServer& operator=(const metricsServer&) = delete;
+
+        bool start(const char* socketPath);
+        void stop();
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// Trace file layout:
+//   "C8TR" + version byte + initial state (PC, I, SP, DT, ST, V0-VF)
+//   blocks of [raw size][compressed size][record count] (u32 little endian)
+//   followed by the zlib compressed records
+//
+// Each record is:
+//   zigzag varint   PC - (previous PC + 2)
+//   2 bytes         opcode (big endian)
+//   1 byte          flags (TRACE_*)
+//   TRACE_V         varint mask of changed V registers, then their new values
+//   TRACE_I         zigzag varint I delta
+//   TRACE_SP        zigzag varint SP delta
+//   TRACE_DT        value written by FX15
+//   TRACE_ST        value written by FX18
+//   TRACE_MEM       varint address, length byte, written bytes
+//
+// Timers are recorded whenever an instruction writes them, even if the value
+// didn't change. The 60Hz countdown happens outside of execute() and is not
+// part of the trace, so the value before a write differs between emulators.
+
+#define TRACE_V   0x01
+#define TRACE_I   0x02
+#define TRACE_SP  0x04
+#define TRACE_DT  0x08
+#define TRACE_ST  0x10
+#define TRACE_MEM 0x20
+
+// State an instruction is able to change (RAM writes are tracked separately)
+struct traceState {
+    uint16_t PC;
+    uint16_t I;
+    uint16_t SP;
+    uint8_t DT;
+    uint8_t ST;
+    uint8_t V[16];
+};
+
+// One decoded instruction record
+struct traceRecord {
+    uint16_t PC;
+    uint16_t opcode;
+    uint8_t flags;
+    uint16_t VMask;
+    uint8_t V[16];      // Only entries set in VMask are meaningful
+    uint16_t I;
+    uint16_t SP;
+    uint8_t DT;
+    uint8_t ST;
+    uint16_t memAddr;
+    uint8_t memLen;
+    uint8_t mem[16];
+};
+
+// Encodes records on the emulation thread, compresses and writes
+// full blocks on a background thread
+class traceWriter {
+    private:
+
+        struct traceBlock {
+            std::vector<uint8_t> data;
+            size_t size = 0;
+            uint32_t records = 0;
+        };
+
+        FILE* file = nullptr;
+
+        traceBlock current;
+        uint16_t lastPC = 0;
+
+        // Blocks handed over to the writer thread, and emptied ones to reuse
+        std::deque<traceBlock> pending;
+        std::vector<traceBlock> spare;
+        std::mutex queueMutex;
+        std::condition_variable queueCV;
+        bool stopping = false;
+        std::thread writer;
+
+        // Set by the writer thread when a block couldn't be written
+        bool failed = false;
+
+        std::vector<uint8_t> compressed;
+
+        void submitBlock();
+        void writerLoop();
+        void writeBlock(const traceBlock& block);
+
+    public:
+        traceWriter() = default;
+        ~traceWriter();
+
+        traceWriter(const traceWriter&) = delete;
+        traceWriter& operator=(const traceWriter&) = delete;
+
+        bool open(const char* path, const traceState& initial);
+        bool close();
+
+        void record(const traceState& before, const traceState& after, uint16_t opcode,
+                    uint16_t memAddr, uint8_t memLen, uint8_t timerWrites, const uint8_t RAM[]);
+};
+
+// Decodes a trace file record by record
+class traceReader {
+    private:
+        FILE* file = nullptr;
+
+        std::vector<uint8_t> block;
+        std::vector<uint8_t> compressed;
+        size_t blockPos = 0;
+
+        traceState current;
+        bool corrupt = false;
+
+        bool readBlock();
+        bool decode(traceRecord& rec);
+
+    public:
+        traceReader();
+        ~traceReader();
+
+        traceReader(const traceReader&) = delete;
+        traceReader& operator=(const traceReader&) = delete;
+
+        bool open(const char* path);
+        bool next(traceRecord& rec);
+
+        // Whether next() stopped on a decode error rather than the end of the trace
+        bool isCorrupt() const { return corrupt; }
+
+        // Registers after the last decoded record, PC is the last record's
+        const traceState& state() const { return current; }
+};
+
+#endif
@@ -1,13 +1,18 @@
 #include <chip8.h>
+#include <trace.h>
+#include <metrics.h>
 #include <cmath>
 #include <vector>
 #include <iostream>
+#include <cstring>
 #include "SDL3/SDL.h"
 #include "SDL3/SDL_main.h"
 
 const int WINDOW_WIDTH = 1024;
 const int WINDOW_HEIGHT = 512;
 
+const Uint64 VIP_FRAME_NS = SDL_NS_PER_SECOND / 60;
+
 // Maps SDL key states to the chip 8 control scheme
 void getInput(bool keys[]){
     const bool *key_states = SDL_GetKeyboardState(NULL);
@@ -63,6 +68,30 @@ int main(int argc, char* argv[]){
     if(!c8.loadROM(argv[1]))
         return EXIT_FAILURE;
 
+    metrics stats;
+    metricsServer statsServer(stats);
+    c8.setMetrics(&stats);
+
+    // Optional execution trace (see chip8-tracediff), metrics socket
+    // and COSMAC VIP timing
+    traceWriter tracer;
+    bool vipTiming = false;
+    for(int i = 2; i < argc; ++i){
+        if(std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+            traceState initial;
+            c8.captureState(initial);
+
+            if(!tracer.open(argv[++i], initial))
+                return EXIT_FAILURE;
+            c8.setTracer(&tracer);
+        } else if(std::strcmp(argv[i], "--metrics") == 0 && i + 1 < argc){
+            if(!statsServer.start(argv[++i]))
+                return EXIT_FAILURE;
+        } else if(std::strcmp(argv[i], "--vip") == 0){
+            vipTiming = true;
+        }
+    }
+
     //c8.readRAM();
     //c8.disassemble();
 
@@ -100,7 +129,13 @@ int main(int argc, char* argv[]){
     // Emulator loop
     Uint64 currentTick;
     Uint64 executionTick = 0;
+    Uint64 lastTickStart = 0;   // Only used to count missed ticks
     Uint64 timerTick = 0;
+    Uint64 ipsTick = 0;
+    uint64_t ipsInstructions = 0;
+    Uint64 currentNS;
+    Uint64 frameNS = SDL_GetTicksNS();
+    bool wasBeeping = false;
     SDL_Event e;
 
     bool keys[16]{};
@@ -118,13 +153,55 @@ int main(int argc, char* argv[]){
             beep(stream);
 
         getInput(keys);
-        if(currentTick - executionTick >= 1) {
-            c8.fetch();
-            c8.decode();
-            c8.execute(1, keys);
+        bool frameDue;
+        if(vipTiming) {
+            currentNS = SDL_GetTicksNS();
+            frameDue = currentNS >= frameNS;
+        } else
+            frameDue = currentTick - executionTick >= 1;
+
+        if(frameDue) {
+            // The audio queue is sampled once per tick, each query takes the stream lock.
+            // The queue running dry while the last tick was already beeping is an
+            // underrun, starting a new beep with an empty queue isn't
+            int queued = SDL_GetAudioStreamQueued(stream);
+            stats.audioQueued.set(queued);
+
+            bool beeping = c8.isBeeping();
+            if(beeping && wasBeeping && queued == 0)
+                stats.audioUnderruns.add(1);
+            wasBeeping = beeping;
+
+            if(vipTiming) {
+                // Frames that are a whole period late are skipped, not run back to back
+                if(currentNS - frameNS >= VIP_FRAME_NS) {
+                    Uint64 missed = (currentNS - frameNS) / VIP_FRAME_NS;
+                    stats.droppedFrames.add(missed);
+                    frameNS += missed * VIP_FRAME_NS;
+                }
+                frameNS += VIP_FRAME_NS;
+            } else {
+                // Ticks between the start of the last one and this one were missed,
+                // including time spent inside a slow frame
+                if(lastTickStart != 0 && currentTick - lastTickStart > 1)
+                    stats.droppedFrames.add(currentTick - lastTickStart - 1);
+                lastTickStart = currentTick;
+            }
+
+            Uint64 startNS = SDL_GetTicksNS();
+            if(vipTiming)
+                // One frame of VIP machine cycles, this also ticks the timers
+                c8.runFrame(1, keys);
+            else {
+                c8.fetch();
+                c8.decode();
+                c8.execute(1, keys);
+            }
+            Uint64 emulatedNS = SDL_GetTicksNS();
             
             // Updates texture with the Video Buffer data
             SDL_UpdateTexture(gSDLTexture, NULL, c8.VBUF, 64 * sizeof(uint32_t)); 
+            Uint64 uploadedNS = SDL_GetTicksNS();
 
             // Clears rendering target (screen)
             SDL_RenderClear(gSDLRenderer);
@@ -134,14 +211,26 @@ int main(int argc, char* argv[]){
 
             // Updates screen with backbuffer content
             SDL_RenderPresent(gSDLRenderer);        
+            Uint64 presentedNS = SDL_GetTicksNS();
+
+            stats.emulateTime.observe(emulatedNS - startNS);
+            stats.uploadTime.observe(uploadedNS - emulatedNS);
+            stats.presentTime.observe(presentedNS - uploadedNS);
 
             executionTick = SDL_GetTicks();
         }
 
-        if(currentTick - timerTick >= 10) {
+        if(!vipTiming && currentTick - timerTick >= 10) {
             c8.decreaseTimers();
             timerTick = SDL_GetTicks();
         }
+
+        if(currentTick - ipsTick >= 1000) {
+            uint64_t executed = stats.instructions.get();
+            stats.ips.set((executed - ipsInstructions) * 1000.0 / (currentTick - ipsTick));
+            ipsInstructions = executed;
+            ipsTick = currentTick;
+        }
         
     }
 
@@ -1,4 +1,6 @@
 #include <chip8.h>
+#include <trace.h>
+#include <metrics.h>
 #include <iostream>
 #include <fstream>
 #include <random>
@@ -6,6 +8,34 @@
 #define STACK_UPPER_LIMIT 0x4F
 #define PROGRAM_SPACE_START 0x200
 
+// COSMAC VIP timing, in machine cycles (8 clocks of the 1.7609MHz CDP1802)
+#define VIP_CYCLES_PER_FRAME 3668   // One 60Hz display frame
+#define VIP_DISPLAY_CYCLES 1024     // Stolen each frame by the CDP1861 display DMA
+#define VIP_FETCH_CYCLES 40         // Interpreter fetch and decode loop
+#define VIP_SKIP_CYCLES 4           // Extra cost when a conditional skips
+
+// Base cost of each instruction group, by the opcode's first nibble.
+// Variable parts (00E0, DXYN rows, FX33 digits, FX55/FX65 registers and
+// the other FXNN routines) are added in execute()
+static const uint16_t vipCost[16] = {
+    10,     // 0 00EE
+    12,     // 1 JUMP
+    26,     // 2 CALL
+    10,     // 3 SKIP VX == NN
+    10,     // 4 SKIP VX != NN
+    14,     // 5 SKIP VX == VY
+    6,      // 6 VX = NN
+    10,     // 7 VX += NN
+    20,     // 8 ALU
+    14,     // 9 SKIP VX != VY
+    12,     // A I = NNN
+    22,     // B JUMP0
+    36,     // C RANDOM
+    26,     // D DRAW, plus per row
+    14,     // E SKIP KEY
+    10      // F FX07, FX15, FX18
+};
+
 chip8::chip8() : RAM{}, V{} { 
     
     PC = PROGRAM_SPACE_START;
@@ -22,6 +52,14 @@ chip8::chip8() : RAM{}, V{} {
     NN = 0;
     NNN = 0;
 
+    memWriteAddr = 0;
+    memWriteLen = 0;
+    timerWrites = 0;
+
+    cycles = 0;
+    cycleBudget = 0;
+    vblankWait = false;
+
     uint8_t fontset[80] =  
     {
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -110,18 +148,39 @@ void chip8::execute(bool modernShift, bool keys[]){
     uint8_t flagResult;
     bool hasJumped;
     hasJumped = false;
+    memWriteLen = 0;
+    timerWrites = 0;
+
+    vblankWait = false;
+
+    bool skipped = false;
+    uint32_t extraCycles = 0;
+
+    traceState before;
+    if(tracer)
+        captureState(before);
     
     switch(instruction){
         case 0x0:
-            if(NN == 0x00)
+            if(NN == 0x00){
                 std::cout << "0 invalid opcode: 0x0000\n";
+                if(stats)
+                    stats->invalidOpcodes.add(1);
+            }
             else if(NN == 0xE0){ // 00E0 CLEAR SCREEN 
                     for(int i = 0; i < 2048; ++i){
                         VBUF[i] = 0xFF000000;
                     }
+                    // Clears the 256 byte display page one byte at a time
+                    extraCycles = 3068;
             }
             else if(NN == 0xEE) // 00EE RETURN FROM SUBROUTINE
                 PC = (RAM[SP + 1] << 8) + RAM[SP + 2]; 
+            else {
+                std::cout << "0 invalid opcode: " << std::hex << opcode << "\n";
+                if(stats)
+                    stats->invalidOpcodes.add(1);
+            }
                 SP += 2; 
             break;
         case 0x1: // 1NNN JUMP TO NN
@@ -130,6 +189,8 @@ void chip8::execute(bool modernShift, bool keys[]){
             break;
         case 0x2: // 2NNN CALL SUBROUTINE
             // One stack address = 2 RAM addresses
+            memWriteAddr = SP - 1;
+            memWriteLen = 2;
             RAM[SP] = PC & 0x0FF; 
             RAM[SP - 1] = (PC & 0xFF00) >> 8;
             SP -= 2;
@@ -137,16 +198,22 @@ void chip8::execute(bool modernShift, bool keys[]){
             hasJumped = true;
             break;
         case 0x3: // 3XNN IF VX == NN SKIP
-            if(V[X] == NN)
+            if(V[X] == NN){
                 PC += 2;
+                skipped = true;
+            }
             break;
         case 0x4: // 4XNN IF VX != NN SKIP
-            if(V[X] != NN)
+            if(V[X] != NN){
                 PC += 2;
+                skipped = true;
+            }
             break;
         case 0x5: // 5XY0 IF VX == VY SKIP
-            if(V[X] == V[Y])
+            if(V[X] == V[Y]){
                 PC += 2;
+                skipped = true;
+            }
             break;
         case 0x6: // 6XNN SET VX TO NN
             V[X] = NN;
@@ -207,12 +274,16 @@ void chip8::execute(bool modernShift, bool keys[]){
                     break;        
                 default:
                     std::cout << "8 invalid opcode: " << opcode << "\n";
+                    if(stats)
+                        stats->invalidOpcodes.add(1);
                     break;
                 }
             break;
         case 0x9: // 9XY0 IF X != Y SKIP
-            if(V[X] != V[Y])
+            if(V[X] != V[Y]){
                 PC += 2;
+                skipped = true;
+            }
             break;
         case 0xA: // ANNN set I to NNN
             I = NNN;
@@ -232,6 +303,12 @@ void chip8::execute(bool modernShift, bool keys[]){
 
                 // Clears the flag register
                 V[0xF] = 0;
+
+                // The VIP waits for vertical blank before drawing, and each
+                // row is shifted into place one bit at a time. Only the wait's
+                // cost is modelled (see runFrame), the sprite is drawn right away
+                extraCycles = N * (46 + 8 * (Xd % 8));
+                vblankWait = true;
                 
                 uint8_t spriteRow;
                 uint8_t currentPixel;
@@ -270,11 +347,19 @@ void chip8::execute(bool modernShift, bool keys[]){
             break;  
         case 0xE:
             if(NN == 0x9E) { // EX9NN SKIP IF KEY PRESSED
-                if(keys[V[X]])
+                if(keys[V[X]]){
                     PC += 2;
+                    skipped = true;
+                }
             } else if(NN == 0xA1) { // EXA1 SKIP IF KEY NOT PRESSED
-                if(!keys[V[X]])
+                if(!keys[V[X]]){
                     PC += 2;
+                    skipped = true;
+                }
+            } else {
+                std::cout << "e invalid opcode: " << std::hex << opcode << "\n";
+                if(stats)
+                    stats->invalidOpcodes.add(1);
             }
             break;  
         case 0xF:
@@ -296,16 +381,20 @@ void chip8::execute(bool modernShift, bool keys[]){
 
                     if(!keyPressed)
                         PC -= 2;
+                    extraCycles = 10;
                     break;
                 }
                 case 0x15: // FX15 DELAY TIMER = VX
                     DT = V[X];
+                    timerWrites = TRACE_DT;
                     break;
                 case 0x18: // FX18 SOUND TIMER = VX
                     ST = V[X];
+                    timerWrites = TRACE_ST;
                     break;
                 case 0x1E: // FX1E I += VX
                     I += V[X];
+                    extraCycles = 6;
                     if(I > 0x1000)
                         V[0xF] = 1;
                     else
@@ -313,32 +402,58 @@ void chip8::execute(bool modernShift, bool keys[]){
                     break;
                 case 0x29: // FX29 SET I TO FONT CHARACTER
                     I = 0x50 + (5 * V[X]);
+                    extraCycles = 6;
                     break;
                 case 0x33: // FX33 VX TO BCD
+                    memWriteAddr = I;
+                    memWriteLen = 3;
                     RAM[I] = (V[X] / 100) % 10;
                     RAM[I + 1] = (V[X] / 10) % 10;
                     RAM[I + 2] = V[X] % 10;
+                    // Digits are found by repeated subtraction
+                    extraCycles = 70 + 16 * (RAM[I] + RAM[I + 1] + RAM[I + 2]);
                     break;
                 case 0x55: // FX55 STORE MEMORY
+                    memWriteAddr = I;
+                    memWriteLen = X + 1;
                     for(int i = 0; i <= X; i++)
                         RAM[I + i] = V[i];
+                    extraCycles = 4 + 14 * (X + 1);
                     break;
                 case 0x65: // FX65 LOAD MEMORY
                     for(int i = 0; i <= X; i++)
                         V[i] = RAM[I + i];
+                    extraCycles = 4 + 14 * (X + 1);
                     break;
                 default:
                     std::cout << "f invalid opcode: " << std::hex << opcode << "\n";
+                    if(stats)
+                        stats->invalidOpcodes.add(1);
                     break;
             }
             break;
         default:
             std::cout << "op invalid opcode: " << std::hex << opcode << "\n";
+            if(stats)
+                stats->invalidOpcodes.add(1);
             break;
     }
 
         if(!hasJumped)
             PC += 2;
+
+        cycles = VIP_FETCH_CYCLES + vipCost[instruction] + extraCycles;
+        if(skipped)
+            cycles += VIP_SKIP_CYCLES;
+
+        if(stats)
+            stats->instructions.add(1);
+
+        if(tracer){
+            traceState after;
+            captureState(after);
+            tracer->record(before, after, opcode, memWriteAddr, memWriteLen, timerWrites, RAM);
+        }
 }
 
 void chip8::disassemble(){
@@ -483,6 +598,29 @@ void chip8::disassemble(){
     } 
 }
 
+// Runs instructions until one VIP frame worth of machine cycles is spent,
+// then ticks the timers. Cycles run past the end of a frame, or drawing
+// deferred to the next vertical blank, are charged to the next frame
+void chip8::runFrame(bool modernShift, bool keys[]){
+    cycleBudget += VIP_CYCLES_PER_FRAME - VIP_DISPLAY_CYCLES;
+
+    while(cycleBudget > 0){
+        fetch();
+        decode();
+        execute(modernShift, keys);
+
+        cycleBudget -= static_cast<int32_t>(cycles);
+
+        // The rest of this frame is spent waiting for vertical blank and the
+        // draw's cost is charged to the next one. VBUF is already updated,
+        // so the sprite itself is still presented with this frame
+        if(vblankWait)
+            cycleBudget = -static_cast<int32_t>(cycles);
+    }
+
+    decreaseTimers();
+}
+
 void chip8::decreaseTimers(){
     if(DT > 0)
         DT--;
@@ -490,6 +628,26 @@ void chip8::decreaseTimers(){
         ST--;
 }
 
+void chip8::captureState(traceState& state){
+    state.PC = PC;
+    state.I = I;
+    state.SP = SP;
+    state.DT = DT;
+    state.ST = ST;
+    for(int i = 0; i < 16; ++i)
+        state.V[i] = V[i];
+}
+
+// Passing nullptr disables tracing
+void chip8::setTracer(traceWriter* t){
+    tracer = t;
+}
+
+// Passing nullptr disables metrics
+void chip8::setMetrics(metrics* m){
+    stats = m;
+}
+
 bool chip8::isBeeping(){
     if(ST > 0)
         return true;
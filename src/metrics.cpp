@@ -0,0 +1,185 @@
+#include <metrics.h>
+#include <iostream>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define METRICS_POLL_MS 100    // How often the server checks for shutdown
+
+const uint64_t metricsHistogram::bounds[METRICS_BUCKETS] = {
+    1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 50000000
+};
+
+// Appends printf style text to out, sized from vsnprintf so nothing is cut off
+static void appendf(std::string& out, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    int length = std::vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+
+    if(length <= 0)
+        return;
+
+    size_t start = out.size();
+    out.resize(start + length + 1);
+
+    va_start(args, format);
+    std::vsnprintf(&out[start], length + 1, format, args);
+    va_end(args);
+
+    out.resize(start + length);
+}
+
+void metricsHistogram::observe(uint64_t ns){
+    int bucket = 0;
+    while(bucket < METRICS_BUCKETS && ns > bounds[bucket])
+        bucket++;
+
+    buckets[bucket].store(buckets[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+// _count is the +Inf bucket total, so a scrape never sees the two disagree
+void metricsHistogram::render(std::string& out, const char* name, const char* help) const {
+    appendf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    for(int i = 0; i < METRICS_BUCKETS; ++i){
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        appendf(out, "%s_bucket{le=\"%g\"} %llu\n", name, bounds[i] / 1e9,
+                static_cast<unsigned long long>(cumulative));
+    }
+    cumulative += buckets[METRICS_BUCKETS].load(std::memory_order_relaxed);
+
+    appendf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, static_cast<unsigned long long>(cumulative));
+    appendf(out, "%s_sum %.9f\n", name, sum.load(std::memory_order_relaxed) / 1e9);
+    appendf(out, "%s_count %llu\n", name, static_cast<unsigned long long>(cumulative));
+}
+
+static void renderCounter(std::string& out, const char* name, const char* help, const metricsCounter& c){
+    appendf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    appendf(out, "%s %llu\n", name, static_cast<unsigned long long>(c.get()));
+}
+
+static void renderGauge(std::string& out, const char* name, const char* help, const metricsGauge& g){
+    appendf(out, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    appendf(out, "%s %.17g\n", name, g.get());
+}
+
+std::string metrics::render() const {
+    std::string out;
+
+    renderCounter(out, "chip8_instructions_total", "Instructions executed", instructions);
+    renderCounter(out, "chip8_invalid_opcodes_total", "Invalid opcodes encountered", invalidOpcodes);
+    renderGauge(out, "chip8_instructions_per_second", "Instructions executed over the last second", ips);
+
+    emulateTime.render(out, "chip8_emulate_seconds", "Time spent in fetch, decode and execute");
+    uploadTime.render(out, "chip8_upload_seconds", "Time spent uploading the video buffer");
+    presentTime.render(out, "chip8_present_seconds", "Time spent rendering and presenting a frame");
+
+    renderCounter(out, "chip8_dropped_frames_total", "Scheduler ticks missed by late frames", droppedFrames);
+    renderGauge(out, "chip8_audio_queued_bytes", "Bytes queued on the audio stream", audioQueued);
+    renderCounter(out, "chip8_audio_underruns_total", "Times the audio queue ran dry during a beep", audioUnderruns);
+
+    return out;
+}
+
+metricsServer::~metricsServer(){
+    stop();
+}
+
+// returns false if the socket couldn't be created
+bool metricsServer::start(const char* socketPath){
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if(std::strlen(socketPath) >= sizeof(addr.sun_path)){
+        std::cerr << "Metrics socket path too long\n";
+        return false;
+    }
+    std::strcpy(addr.sun_path, socketPath);
+
+    listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFD < 0){
+        std::cerr << "Couldn't create metrics socket\n";
+        return false;
+    }
+
+    // Removes a socket left behind by a previous run, but never anything else
+    struct stat existing;
+    if(lstat(socketPath, &existing) == 0){
+        if(!S_ISSOCK(existing.st_mode)){
+            std::cerr << "Metrics socket path " << socketPath << " exists and is not a socket\n";
+            ::close(listenFD);
+            listenFD = -1;
+            return false;
+        }
+        unlink(socketPath);
+    }
+
+    if(bind(listenFD, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFD, 4) < 0){
+        std::cerr << "Couldn't bind metrics socket: " << std::strerror(errno) << "\n";
+        ::close(listenFD);
+        listenFD = -1;
+        return false;
+    }
+
+    path = socketPath;
+    stopping = false;
+    server = std::thread(&metricsServer::serverLoop, this);
+    return true;
+}
+
+void metricsServer::stop(){
+    if(listenFD < 0)
+        return;
+
+    stopping = true;
+    server.join();
+
+    ::close(listenFD);
+    listenFD = -1;
+    unlink(path.c_str());
+}
+
+void metricsServer::serverLoop(){
+    pollfd pfd{listenFD, POLLIN, 0};
+
+    while(!stopping){
+        if(poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        int client = accept(listenFD, nullptr, nullptr);
+        if(client < 0)
+            continue;
+
+        // The request itself is ignored, every path returns the metrics,
+        // but it is drained so the client doesn't see a reset
+        char request[1024];
+        pollfd cfd{client, POLLIN, 0};
+        if(poll(&cfd, 1, METRICS_POLL_MS) > 0)
+            recv(client, request, sizeof(request), 0);
+
+        std::string body = registry.render();
+        std::string response = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "\r\n" + body;
+
+        size_t sent = 0;
+        while(sent < response.size()){
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if(n <= 0)
+                break;
+            sent += n;
+        }
+
+        ::close(client);
+    }
+}
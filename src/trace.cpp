@@ -0,0 +1,425 @@
+#include <trace.h>
+#include <iostream>
+#include <cstring>
+#include <zlib.h>
+
+#define TRACE_VERSION 1
+#define TRACE_BLOCK_SIZE 65536
+#define TRACE_MAX_RECORD 64         // Worst case encoded record is 52 bytes
+#define TRACE_MAX_PENDING 8         // Blocks queued before the emulator waits
+
+static uint8_t* putVarint(uint8_t* p, uint32_t value){
+    while(value >= 0x80){
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static uint8_t* putSigned(uint8_t* p, int32_t value){
+    return putVarint(p, (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31));
+}
+
+// returns nullptr if the varint runs past end
+static const uint8_t* getVarint(const uint8_t* p, const uint8_t* end, uint32_t& value){
+    value = 0;
+    for(int shift = 0; p < end && shift < 35; shift += 7){
+        uint8_t byte = *p++;
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return p;
+    }
+    return nullptr;
+}
+
+static const uint8_t* getSigned(const uint8_t* p, const uint8_t* end, int32_t& value){
+    uint32_t raw;
+    p = getVarint(p, end, raw);
+    value = static_cast<int32_t>(raw >> 1) ^ -static_cast<int32_t>(raw & 1);
+    return p;
+}
+
+static void putU32(uint8_t* p, uint32_t value){
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t getU32(const uint8_t* p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void putState(uint8_t* p, const traceState& s){
+    p[0] = s.PC >> 8;
+    p[1] = s.PC;
+    p[2] = s.I >> 8;
+    p[3] = s.I;
+    p[4] = s.SP >> 8;
+    p[5] = s.SP;
+    p[6] = s.DT;
+    p[7] = s.ST;
+    std::memcpy(p + 8, s.V, 16);
+}
+
+static void getState(const uint8_t* p, traceState& s){
+    s.PC = p[0] << 8 | p[1];
+    s.I = p[2] << 8 | p[3];
+    s.SP = p[4] << 8 | p[5];
+    s.DT = p[6];
+    s.ST = p[7];
+    std::memcpy(s.V, p + 8, 16);
+}
+
+traceWriter::~traceWriter(){
+    close();
+}
+
+// returns false if the trace file couldn't be created
+bool traceWriter::open(const char* path, const traceState& initial){
+    close();
+
+    file = std::fopen(path, "wb");
+    if(!file){
+        std::cerr << "Couldn't open trace file\n";
+        return false;
+    }
+
+    uint8_t header[29] = {'C', '8', 'T', 'R', TRACE_VERSION};
+    putState(header + 5, initial);
+    if(std::fwrite(header, 1, sizeof(header), file) != sizeof(header)){
+        std::cerr << "Couldn't write trace file\n";
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+
+    current.data.resize(TRACE_BLOCK_SIZE + TRACE_MAX_RECORD);
+    current.size = 0;
+    current.records = 0;
+    lastPC = initial.PC - 2;
+
+    failed = false;
+    stopping = false;
+    writer = std::thread(&traceWriter::writerLoop, this);
+    return true;
+}
+
+// Flushes every buffered record and closes the file
+// returns false if any of the trace couldn't be written
+bool traceWriter::close(){
+    if(!file)
+        return true;
+
+    if(current.records > 0)
+        submitBlock();
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueCV.notify_all();
+    writer.join();
+
+    if(std::fclose(file) != 0)
+        failed = true;
+    file = nullptr;
+
+    if(failed)
+        std::cerr << "Trace file is incomplete, records after the first failed block were lost\n";
+    return !failed;
+}
+
+void traceWriter::record(const traceState& before, const traceState& after, uint16_t opcode,
+                         uint16_t memAddr, uint8_t memLen, uint8_t timerWrites, const uint8_t RAM[]){
+    uint8_t* start = current.data.data() + current.size;
+    uint8_t* p = start;
+
+    p = putSigned(p, static_cast<int32_t>(before.PC) - static_cast<int32_t>(lastPC + 2));
+    lastPC = before.PC;
+
+    *p++ = opcode >> 8;
+    *p++ = opcode;
+
+    uint8_t* flags = p++;
+    *flags = 0;
+
+    uint16_t VMask = 0;
+    for(int i = 0; i < 16; ++i){
+        if(before.V[i] != after.V[i])
+            VMask |= 1 << i;
+    }
+
+    if(VMask){
+        *flags |= TRACE_V;
+        p = putVarint(p, VMask);
+        for(int i = 0; i < 16; ++i){
+            if(VMask & (1 << i))
+                *p++ = after.V[i];
+        }
+    }
+    if(before.I != after.I){
+        *flags |= TRACE_I;
+        p = putSigned(p, static_cast<int32_t>(after.I) - static_cast<int32_t>(before.I));
+    }
+    if(before.SP != after.SP){
+        *flags |= TRACE_SP;
+        p = putSigned(p, static_cast<int32_t>(after.SP) - static_cast<int32_t>(before.SP));
+    }
+    if(timerWrites & TRACE_DT){
+        *flags |= TRACE_DT;
+        *p++ = after.DT;
+    }
+    if(timerWrites & TRACE_ST){
+        *flags |= TRACE_ST;
+        *p++ = after.ST;
+    }
+    if(memLen > 0){
+        *flags |= TRACE_MEM;
+        p = putVarint(p, memAddr);
+        *p++ = memLen;
+        for(int i = 0; i < memLen; ++i)
+            *p++ = RAM[(memAddr + i) & 0x0FFF];
+    }
+
+    current.size += p - start;
+    current.records++;
+
+    if(current.size >= TRACE_BLOCK_SIZE)
+        submitBlock();
+}
+
+// Hands the current block to the writer thread and picks up an empty one,
+// waits if the writer has fallen too far behind
+void traceWriter::submitBlock(){
+    std::unique_lock<std::mutex> lock(queueMutex);
+    queueCV.wait(lock, [this]{ return pending.size() < TRACE_MAX_PENDING; });
+
+    pending.push_back(std::move(current));
+
+    if(!spare.empty()){
+        current = std::move(spare.back());
+        spare.pop_back();
+    } else {
+        current = traceBlock{};
+        current.data.resize(TRACE_BLOCK_SIZE + TRACE_MAX_RECORD);
+    }
+    current.size = 0;
+    current.records = 0;
+
+    lock.unlock();
+    queueCV.notify_all();
+}
+
+void traceWriter::writerLoop(){
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    while(true){
+        queueCV.wait(lock, [this]{ return !pending.empty() || stopping; });
+        if(pending.empty())
+            break;
+
+        traceBlock block = std::move(pending.front());
+        pending.pop_front();
+
+        lock.unlock();
+        writeBlock(block);
+        lock.lock();
+
+        spare.push_back(std::move(block));
+        queueCV.notify_all();
+    }
+}
+
+// Once a block is lost the records after it can't be decoded,
+// since each one is a delta against the one before, so writing stops
+void traceWriter::writeBlock(const traceBlock& block){
+    if(failed)
+        return;
+
+    uLongf compressedSize = compressBound(block.size);
+    compressed.resize(compressedSize + 12);
+
+    // Level 1 keeps compression well ahead of the interpreter
+    if(compress2(compressed.data() + 12, &compressedSize, block.data.data(), block.size, 1) != Z_OK){
+        std::cerr << "Trace block compression failed\n";
+        failed = true;
+        return;
+    }
+
+    putU32(compressed.data(), block.size);
+    putU32(compressed.data() + 4, compressedSize);
+    putU32(compressed.data() + 8, block.records);
+    if(std::fwrite(compressed.data(), 1, compressedSize + 12, file) != compressedSize + 12){
+        std::cerr << "Couldn't write trace block\n";
+        failed = true;
+    }
+}
+
+traceReader::traceReader() : current{} {
+}
+
+traceReader::~traceReader(){
+    if(file)
+        std::fclose(file);
+}
+
+// returns false if the file is missing or isn't a trace
+bool traceReader::open(const char* path){
+    file = std::fopen(path, "rb");
+    if(!file){
+        std::cerr << "Couldn't open trace " << path << "\n";
+        return false;
+    }
+
+    uint8_t header[29];
+    if(std::fread(header, 1, sizeof(header), file) != sizeof(header)
+       || std::memcmp(header, "C8TR", 4) != 0 || header[4] != TRACE_VERSION){
+        std::cerr << path << " is not a chip-8 trace\n";
+        return false;
+    }
+
+    getState(header + 5, current);
+    // The first record's PC is encoded against the initial PC
+    current.PC -= 2;
+    block.clear();
+    blockPos = 0;
+    corrupt = false;
+    return true;
+}
+
+// returns false at the end of the file or if the block is corrupted
+bool traceReader::readBlock(){
+    uint8_t header[12];
+    size_t headerSize = std::fread(header, 1, sizeof(header), file);
+
+    // Running out of file exactly between blocks is the normal end of a trace
+    if(headerSize == 0 && std::feof(file))
+        return false;
+
+    if(headerSize != sizeof(header)){
+        std::cerr << "Truncated trace block header\n";
+        corrupt = true;
+        return false;
+    }
+
+    uLongf rawSize = getU32(header);
+    uint32_t compressedSize = getU32(header + 4);
+
+    if(rawSize == 0 || rawSize > TRACE_BLOCK_SIZE + TRACE_MAX_RECORD
+       || compressedSize > compressBound(TRACE_BLOCK_SIZE + TRACE_MAX_RECORD)){
+        std::cerr << "Corrupted trace block header\n";
+        corrupt = true;
+        return false;
+    }
+
+    compressed.resize(compressedSize);
+    block.resize(rawSize);
+    if(std::fread(compressed.data(), 1, compressedSize, file) != compressedSize){
+        std::cerr << "Truncated trace block\n";
+        corrupt = true;
+        return false;
+    }
+
+    if(uncompress(block.data(), &rawSize, compressed.data(), compressedSize) != Z_OK){
+        std::cerr << "Corrupted trace block\n";
+        corrupt = true;
+        return false;
+    }
+
+    block.resize(rawSize);
+    blockPos = 0;
+    return true;
+}
+
+// returns false at the end of the trace, or if it is corrupted (see isCorrupt)
+bool traceReader::next(traceRecord& rec){
+    if(blockPos >= block.size() && !readBlock())
+        return false;
+
+    if(!decode(rec)){
+        std::cerr << "Corrupted trace record\n";
+        corrupt = true;
+        return false;
+    }
+    return true;
+}
+
+bool traceReader::decode(traceRecord& rec){
+    const uint8_t* p = block.data() + blockPos;
+    const uint8_t* end = block.data() + block.size();
+    int32_t delta;
+    uint32_t value;
+
+    p = getSigned(p, end, delta);
+    if(!p || end - p < 3)
+        return false;
+
+    rec.PC = current.PC + 2 + delta;
+    rec.opcode = p[0] << 8 | p[1];
+    rec.flags = p[2];
+    p += 3;
+
+    rec.VMask = 0;
+    rec.I = current.I;
+    rec.SP = current.SP;
+    rec.DT = current.DT;
+    rec.ST = current.ST;
+    rec.memAddr = 0;
+    rec.memLen = 0;
+    std::memcpy(rec.V, current.V, 16);
+
+    if(rec.flags & TRACE_V){
+        if(!(p = getVarint(p, end, value)))
+            return false;
+        rec.VMask = value;
+        for(int i = 0; i < 16; ++i){
+            if(rec.VMask & (1 << i)){
+                if(p >= end)
+                    return false;
+                rec.V[i] = *p++;
+            }
+        }
+    }
+    if(rec.flags & TRACE_I){
+        if(!(p = getSigned(p, end, delta)))
+            return false;
+        rec.I = current.I + delta;
+    }
+    if(rec.flags & TRACE_SP){
+        if(!(p = getSigned(p, end, delta)))
+            return false;
+        rec.SP = current.SP + delta;
+    }
+    if(rec.flags & TRACE_DT){
+        if(p >= end)
+            return false;
+        rec.DT = *p++;
+    }
+    if(rec.flags & TRACE_ST){
+        if(p >= end)
+            return false;
+        rec.ST = *p++;
+    }
+    if(rec.flags & TRACE_MEM){
+        if(!(p = getVarint(p, end, value)) || p >= end)
+            return false;
+        rec.memAddr = value;
+        rec.memLen = *p++;
+        if(rec.memLen > sizeof(rec.mem) || end - p < rec.memLen)
+            return false;
+        std::memcpy(rec.mem, p, rec.memLen);
+        p += rec.memLen;
+    }
+
+    blockPos = p - block.data();
+
+    current.PC = rec.PC;
+    current.I = rec.I;
+    current.SP = rec.SP;
+    current.DT = rec.DT;
+    current.ST = rec.ST;
+    std::memcpy(current.V, rec.V, 16);
+    return true;
+}
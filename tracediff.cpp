@@ -0,0 +1,83 @@
+#include <trace.h>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+// Compares the state reconstructed after each instruction rather than the
+// raw flags, which only say what the encoder chose to store
+bool sameRecord(const traceRecord& a, const traceRecord& b){
+    return a.PC == b.PC && a.opcode == b.opcode
+        && std::memcmp(a.V, b.V, 16) == 0
+        && a.I == b.I && a.SP == b.SP && a.DT == b.DT && a.ST == b.ST
+        && a.memAddr == b.memAddr && a.memLen == b.memLen
+        && std::memcmp(a.mem, b.mem, a.memLen) == 0;
+}
+
+void printRecord(const char* name, const traceRecord& rec){
+    std::cout << std::hex << std::setfill('0');
+    std::cout << name << ": PC " << std::setw(3) << rec.PC << "  op " << std::setw(4) << rec.opcode << "\n";
+
+    std::cout << "    V";
+    for(int i = 0; i < 16; ++i)
+        std::cout << " " << std::setw(2) << static_cast<int>(rec.V[i]);
+    std::cout << "\n";
+
+    std::cout << "    I " << std::setw(3) << rec.I << "  SP " << std::setw(2) << rec.SP
+              << "  DT " << std::setw(2) << static_cast<int>(rec.DT)
+              << "  ST " << std::setw(2) << static_cast<int>(rec.ST) << "\n";
+
+    if(rec.memLen > 0){
+        std::cout << "    RAM[" << std::setw(3) << rec.memAddr << "]";
+        for(int i = 0; i < rec.memLen; ++i)
+            std::cout << " " << std::setw(2) << static_cast<int>(rec.mem[i]);
+        std::cout << "\n";
+    }
+
+    std::cout << std::dec;
+}
+
+// Finds the first instruction where two traces disagree
+// returns 0 if they match, 1 if they diverge, 2 on error
+int main(int argc, char* argv[]){
+    if(argc != 3){
+        std::cerr << "usage: chip8-tracediff <trace-a> <trace-b>\n";
+        return 2;
+    }
+
+    traceReader a, b;
+    if(!a.open(argv[1]) || !b.open(argv[2]))
+        return 2;
+
+    traceRecord recA, recB;
+    uint64_t index = 0;
+
+    while(true){
+        bool hasA = a.next(recA);
+        bool hasB = b.next(recB);
+
+        if(a.isCorrupt() || b.isCorrupt()){
+            std::cerr << (a.isCorrupt() ? argv[1] : argv[2]) << " is corrupted after " << index << " instructions\n";
+            return 2;
+        }
+
+        if(!hasA && !hasB){
+            std::cout << "traces match (" << index << " instructions)\n";
+            return 0;
+        }
+
+        if(hasA != hasB){
+            std::cout << (hasA ? argv[2] : argv[1]) << " ends after " << index << " instructions\n";
+            printRecord(hasA ? argv[1] : argv[2], hasA ? recA : recB);
+            return 1;
+        }
+
+        if(!sameRecord(recA, recB)){
+            std::cout << "traces diverge at instruction " << index << "\n";
+            printRecord(argv[1], recA);
+            printRecord(argv[2], recB);
+            return 1;
+        }
+
+        ++index;
+    }
+}